@@ -0,0 +1,215 @@
+# CSH::Theme -- Shared helpers for the weblogin theme build tools.
+#
+# The scripts in tools/ all work on the same tree: templates under
+# weblogin/templates that reference static assets under weblogin/images by
+# root-relative /images/ URLs.  This module holds the file handling and the
+# template and stylesheet reference parsing they have in common.
+#
+# See LICENSE for licensing terms.
+
+package CSH::Theme;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use Cwd qw(abs_path);
+use Exporter qw(import);
+use File::Basename qw(dirname);
+use File::Find qw(find);
+use File::Path qw(mkpath);
+use File::Spec;
+
+our @EXPORT_OK = qw(asset_refs css_refs find_files minify_template slurp spew
+                    template_files template_output template_path
+                    theme_root);
+
+# Tags whose src or href loads a subresource of the page, as opposed to
+# linking to another page.  link counts as a subresource unless its rel is a
+# navigation hint.
+our %RESOURCE_TAGS = map { $_ => 1 } qw(audio embed iframe img input link
+                                        script source track video);
+
+# Return the path to the weblogin tree in the source checkout, found relative
+# to the tools directory.
+sub theme_root {
+    my $tools = abs_path (dirname ($0));
+    return File::Spec->catdir (dirname ($tools), 'weblogin');
+}
+
+# Read an entire file and return its contents.
+sub slurp {
+    my ($path) = @_;
+    open (my $fh, '<', $path) or die "$0: cannot open $path: $!\n";
+    binmode $fh;
+    local $/;
+    my $data = <$fh>;
+    close $fh;
+    return $data;
+}
+
+# Write data to a file, creating any missing parent directories.
+sub spew {
+    my ($path, $data) = @_;
+    mkpath (dirname ($path));
+    open (my $fh, '>', $path) or die "$0: cannot create $path: $!\n";
+    binmode $fh;
+    print {$fh} $data or die "$0: cannot write to $path: $!\n";
+    close ($fh) or die "$0: cannot flush $path: $!\n";
+    return;
+}
+
+# Return all plain files under a directory as paths relative to it, sorted so
+# that output is reproducible.
+sub find_files {
+    my ($dir) = @_;
+    my @files;
+    my $wanted = sub {
+        return unless -f $_;
+        push (@files, File::Spec->abs2rel ($File::Find::name, $dir));
+    };
+    find ({ wanted => $wanted, no_chdir => 1 }, $dir);
+    return sort @files;
+}
+
+# Given the name of a template relative to the template directory, return
+# it followed by every partial it pulls in with WRAPPER, PROCESS, or INCLUDE,
+# recursively and without duplicates.  Partials named by a variable rather
+# than a quoted path can't be followed and are skipped.  The directory may
+# also be a reference to a list of directories searched in order; find the
+# file a returned name refers to with template_path.
+sub template_files {
+    my ($dir, $name) = @_;
+    my (@files, %seen);
+    my @queue = ($name);
+    while (defined (my $file = shift @queue)) {
+        next if $seen{$file}++;
+        my $path = template_path ($dir, $file) or next;
+        push (@files, $file);
+        my $template = slurp ($path);
+        while ($template =~ /\[%[-+~]?\s*(?:WRAPPER|PROCESS|INCLUDE)\s+
+                             (["'])([^"']+)\1/gx) {
+            push (@queue, $2);
+        }
+    }
+    return @files;
+}
+
+# Return the path to the file a template name refers to, searching a
+# directory or a reference to a list of directories in order like Template
+# Toolkit's include path, or undef if there is none.
+sub template_path {
+    my ($dirs, $name) = @_;
+    for my $dir (ref ($dirs) ? @$dirs : ($dirs)) {
+        my $path = File::Spec->catfile ($dir, $name);
+        return $path if -f $path;
+    }
+    return;
+}
+
+# Return every static reference in a template or HTML page as a list of
+# hashes with keys tag, attr, url, resource, and critical.  resource is true
+# if loading the page also loads the URL (an image, script, or stylesheet)
+# and false if it is a link to another page.  critical is true for resources
+# on the critical path of the first render: images, scripts without async or
+# defer, and stylesheets that apply to the screen.  Comments and values built
+# by Template Toolkit directives are skipped, since they can't be resolved
+# statically.  url() references in inline styles are returned as critical
+# resources with tag style.
+sub asset_refs {
+    my ($html) = @_;
+    $html =~ s/<!--.*?-->//gs;
+    $html =~ s/\[%\#.*?%\]//gs;
+    my @refs;
+    while ($html =~ /<([a-zA-Z][a-zA-Z0-9]*)\b([^>]*)>/g) {
+        my ($tag, $attrs) = (lc $1, $2);
+        my ($rel) = ($attrs =~ /\brel\s*=\s*"([^"]*)"/i);
+        my ($media) = ($attrs =~ /\bmedia\s*=\s*"([^"]*)"/i);
+        my $resource = $RESOURCE_TAGS{$tag}
+            && !($tag eq 'link' && defined ($rel)
+                 && $rel =~ /\b(?:alternate|canonical|next|prev)\b/i);
+        my $critical = $resource;
+        if ($tag eq 'script') {
+            $critical = $attrs !~ /\b(?:async|defer)\b/i;
+        } elsif ($tag eq 'link') {
+            $critical = defined ($rel) && $rel =~ /\bstylesheet\b/i
+                && !(defined ($media) && $media =~ /^\s*print\s*\z/i);
+        } elsif ($tag eq 'input') {
+            $critical = $attrs =~ /\btype\s*=\s*"image"/i;
+        }
+        while ($attrs =~ /\b(src|href|action)\s*=\s*"([^"]*)"/gi) {
+            my ($attr, $url) = (lc $1, $2);
+            next if $url =~ /\[%/ || $url eq '' || $url =~ /^#/;
+            my $loads = $attr eq 'action' ? 0 : $resource;
+            push (@refs, { tag => $tag, attr => $attr, url => $url,
+                           resource => $loads,
+                           critical => $loads && $critical });
+        }
+        while ($attrs =~ /\bstyle\s*=\s*"([^"]*)"/gi) {
+            push (@refs, map { { tag => 'style', attr => 'style', url => $_,
+                                 resource => 1, critical => 1 } }
+                         css_refs ($1));
+        }
+    }
+    return @refs;
+}
+
+# Return the part of a template that reaches the browser, approximately:
+# Template Toolkit comments and the [% IF notdefined %] documentation blocks
+# at the top of the stock templates are removed, and other directives are
+# left in place.
+sub template_output {
+    my ($template) = @_;
+    $template =~ s/\[%-?\s*IF\s+notdefined\s*-?%\].*?\[%-?\s*END\s*-?%\]//gs;
+    $template =~ s/\[%\#.*?%\]//gs;
+    return $template;
+}
+
+# Return a minified copy of a template that renders the same page.  The
+# documentation blocks and comments are removed, along with HTML comments
+# other than conditional comments, and every run of whitespace that spans
+# lines is collapsed to a single newline, except inside pre and textarea.
+# A directive followed by a line break and then a tag, another directive, or
+# the end of the template gets the - chomp flag so that Template Toolkit
+# drops the newline after it too; WebLogin's PRE_CHOMP already drops the one
+# before it.  Whitespace that separates words is never removed.
+sub minify_template {
+    my ($template) = @_;
+    my $html = template_output ($template);
+    $html =~ s/<!--(?!\[if|<!).*?-->//gs;
+    my $verbatim = qr{<pre\b.*?</pre>|<textarea\b.*?</textarea>}is;
+    my @tokens = split (m{(\[%.*?%\]|$verbatim)}s, $html);
+
+    # split returns text and the separators alternately, so the text tokens
+    # are the even ones and whatever follows a directive is text.
+    for (my $i = 0; $i < @tokens; $i += 2) {
+        $tokens[$i] =~ s/[ \t]*\n\s*/\n/g;
+    }
+    for (my $i = 1; $i < @tokens; $i += 2) {
+        next unless $tokens[$i] =~ /^\[%/;
+        my $next = $i < $#tokens ? $tokens[$i + 1] : "\n";
+        next unless $next =~ /^\n(?:<|\z)/;
+        $tokens[$i] =~ s/(?<![-=~+])\s*%\]\z/ -%]/;
+    }
+    $html = join ('', @tokens);
+    $html =~ s/^\s+//;
+    $html =~ s/\s*\z/\n/;
+    return $html;
+}
+
+# Return the URLs a stylesheet references with url() or @import, skipping
+# data: URIs, which don't cost a request.
+sub css_refs {
+    my ($css) = @_;
+    $css =~ s{/\*.*?\*/}{}gs;
+    my @refs;
+    while ($css =~ /\burl\(\s*(?:"([^"]*)"|'([^']*)'|([^)\s]*))\s*\)
+                   |\@import\s+(?:"([^"]*)"|'([^']*)')/gx) {
+        my ($url) = grep { defined } ($1, $2, $3, $4, $5);
+        push (@refs, $url) unless $url =~ /^data:/i;
+    }
+    return @refs;
+}
+
+1;
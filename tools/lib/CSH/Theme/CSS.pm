@@ -0,0 +1,243 @@
+# CSH::Theme::CSS -- Stylesheet pruning for the weblogin theme build tools.
+#
+# The theme's stylesheets are cut down to the rules that the markup can
+# actually use: tools/extract-css does this for the templates, producing
+# theme.css, and tools/build-error-pages does it again for each static error
+# page, whose styles are inlined.  This module holds the minimal CSS parser
+# and the selector matching they share.
+#
+# See LICENSE for licensing terms.
+
+package CSH::Theme::CSS;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use Exporter qw(import);
+
+our @EXPORT_OK = qw(markup_used parse_css prune prune_keyframes serialize);
+
+##############################################################################
+# Markup scanning
+##############################################################################
+
+# Scan the given HTML documents or templates and return a reference to a
+# hash with classes, ids, and tags keys, each a hash of the names used.
+# Template Toolkit directives inside attribute values are skipped, since
+# they can't be resolved statically.  html and body are always included,
+# since a rendered page has them even if a template doesn't spell them out.
+sub markup_used {
+    my (@documents) = @_;
+    my %used = (classes => {}, ids => {}, tags => { html => 1, body => 1 });
+    for my $html (@documents) {
+        $html =~ s/<!--.*?-->//gs;
+        $used{tags}{lc $1} = 1 while $html =~ /<([a-zA-Z][a-zA-Z0-9]*)/g;
+        while ($html =~ /\bclass\s*=\s*"([^"]*)"/g) {
+            my $value = $1;
+            $value =~ s/\[%.*?%\]//g;
+            $used{classes}{$_} = 1 for split (' ', $value);
+        }
+        while ($html =~ /\bid\s*=\s*"([^"]*)"/g) {
+            my $value = $1;
+            $used{ids}{$1} = 1 if $value =~ /^\s*([\w-]+)\s*$/;
+        }
+    }
+    return \%used;
+}
+
+##############################################################################
+# CSS parsing
+##############################################################################
+
+# Parse a block of CSS into a list of nodes.  Each node is either a hash with
+# a selectors key and a body key for a style rule, a hash with an at key, a
+# prelude, and a list of child nodes for a nested at-rule, or a hash with an
+# at key and a raw body for an at-rule we don't look inside.  Strings are
+# tracked so that braces inside them don't confuse the parser.
+sub parse_css {
+    my ($css) = @_;
+    my @nodes;
+    my $pos = 0;
+    my $length = length $css;
+    while ($pos < $length) {
+        my $open = find_char ($css, '{', $pos);
+        last unless defined $open;
+        my $prelude = substr ($css, $pos, $open - $pos);
+        $prelude =~ s/^\s+|\s+\z//g;
+        my $close = matching_brace ($css, $open);
+        my $body = substr ($css, $open + 1, $close - $open - 1);
+        if ($prelude =~ /^@(media|supports)\b/) {
+            push (@nodes, { at => $1, prelude => $prelude,
+                            nodes => [ parse_css ($body) ] });
+        } elsif ($prelude =~ /^@/) {
+            push (@nodes, { at => $prelude, raw => $body });
+        } else {
+            push (@nodes, { selectors => [ split_selectors ($prelude) ],
+                            body => $body });
+        }
+        $pos = $close + 1;
+    }
+    return @nodes;
+}
+
+# Return the offset of the next unquoted occurrence of $char at or after
+# $pos, or undef if there is none.
+sub find_char {
+    my ($css, $char, $pos) = @_;
+    my $quote;
+    for my $i ($pos .. length ($css) - 1) {
+        my $c = substr ($css, $i, 1);
+        if ($quote) {
+            $quote = undef if $c eq $quote;
+        } elsif ($c eq '"' || $c eq "'") {
+            $quote = $c;
+        } elsif ($c eq $char) {
+            return $i;
+        }
+    }
+    return;
+}
+
+# Given the offset of an opening brace, return the offset of its matching
+# closing brace.
+sub matching_brace {
+    my ($css, $open) = @_;
+    my $depth = 0;
+    my $quote;
+    for my $i ($open .. length ($css) - 1) {
+        my $c = substr ($css, $i, 1);
+        if ($quote) {
+            $quote = undef if $c eq $quote;
+        } elsif ($c eq '"' || $c eq "'") {
+            $quote = $c;
+        } elsif ($c eq '{') {
+            $depth++;
+        } elsif ($c eq '}') {
+            $depth--;
+            return $i if $depth == 0;
+        }
+    }
+    die "$0: unbalanced braces in CSS\n";
+}
+
+# Split a selector list on the commas that separate selectors, ignoring
+# commas inside brackets, parentheses, and strings.
+sub split_selectors {
+    my ($list) = @_;
+    my (@selectors, $quote);
+    my $depth = 0;
+    my $current = '';
+    for my $c (split (//, $list)) {
+        if ($quote) {
+            $quote = undef if $c eq $quote;
+        } elsif ($c eq '"' || $c eq "'") {
+            $quote = $c;
+        } elsif ($c eq '[' || $c eq '(') {
+            $depth++;
+        } elsif ($c eq ']' || $c eq ')') {
+            $depth--;
+        } elsif ($c eq ',' && $depth == 0) {
+            push (@selectors, $current);
+            $current = '';
+            next;
+        }
+        $current .= $c;
+    }
+    push (@selectors, $current);
+    s/^\s+|\s+\z//g for @selectors;
+    return grep { length } @selectors;
+}
+
+##############################################################################
+# Selector matching
+##############################################################################
+
+# Return true if a selector could match the scanned markup, as returned by
+# markup_used.  Selectors matching any of the patterns in the exclude key of
+# the markup hash never match.  This is deliberately conservative: every
+# class, id, and element named in the selector must be used somewhere, but we don't try to check that they occur
+# in the right structural relationship.  Attribute selectors on class are
+# matched as prefixes or substrings of the used classes; other attribute
+# selectors and pseudo-classes are assumed to match.
+sub selector_used {
+    my ($selector, $used) = @_;
+    for my $pattern (@{ $used->{exclude} || [] }) {
+        return 0 if $selector =~ $pattern;
+    }
+    my $simple = $selector;
+    while ($simple =~ s/\[\s*class\s*([\^*]?)=\s*["']([^"']*)["']\s*\]/ /) {
+        my ($op, $value) = ($1, $2);
+        $value =~ s/^\s+//;
+        my @match = grep {
+            $op eq '^' ? /^\Q$value\E/ : /\Q$value\E/
+        } keys %{ $used->{classes} };
+        return 0 unless @match;
+    }
+    $simple =~ s/\[[^\]]*\]/ /g;
+    $simple =~ s/::?[\w-]+(?:\([^)]*\))?/ /g;
+    for my $class ($simple =~ /\.([\w-]+)/g) {
+        return 0 unless $used->{classes}{$class};
+    }
+    for my $id ($simple =~ /#([\w-]+)/g) {
+        return 0 unless $used->{ids}{$id};
+    }
+    for my $tag ($simple =~ /(?:^|[\s>+~])([a-zA-Z][\w-]*)/g) {
+        return 0 unless $used->{tags}{lc $tag};
+    }
+    return 1;
+}
+
+# Filter a list of parsed nodes down to the ones that can apply to the
+# scanned markup, recursing into @media blocks and dropping any that end up
+# empty.  Returns the surviving nodes.
+sub prune {
+    my ($nodes, $used) = @_;
+    my @kept;
+    for my $node (@$nodes) {
+        if ($node->{nodes}) {
+            my @children = prune ($node->{nodes}, $used);
+            push (@kept, { %$node, nodes => \@children }) if @children;
+        } elsif ($node->{at}) {
+            push (@kept, $node);
+        } else {
+            my @selectors
+                = grep { selector_used ($_, $used) } @{ $node->{selectors} };
+            push (@kept, { %$node, selectors => \@selectors }) if @selectors;
+        }
+    }
+    return @kept;
+}
+
+# Drop @keyframes blocks whose animation name isn't referenced by any of the
+# surviving rules.
+sub prune_keyframes {
+    my ($nodes) = @_;
+    my $text = join ('', map { serialize ($_) }
+                     grep { !($_->{at} && $_->{at} =~ /keyframes/) } @$nodes);
+    my @kept;
+    for my $node (@$nodes) {
+        if ($node->{at} && $node->{at} =~ /^@[\w-]*keyframes\s+([\w-]+)/) {
+            my $name = $1;
+            next unless $text =~ /animation[\w-]*:[^;}]*\b\Q$name\E\b/;
+        }
+        push (@kept, $node);
+    }
+    return @kept;
+}
+
+# Turn a parsed node back into CSS text, one rule per line.
+sub serialize {
+    my ($node) = @_;
+    if ($node->{nodes}) {
+        return "$node->{prelude}\{\n"
+            . join ('', map { serialize ($_) } @{ $node->{nodes} }) . "}\n";
+    } elsif ($node->{at}) {
+        return "$node->{at}\{$node->{raw}}\n";
+    } else {
+        return join (',', @{ $node->{selectors} }) . "{$node->{body}}\n";
+    }
+}
+
+1;
@@ -0,0 +1,62 @@
+/*
+ * Service worker for the weblogin theme assets.
+ *
+ * Registered by partials/serviceworker.tmpl when the driver is run with
+ * --service-worker.  It precaches the fingerprinted assets listed in the
+ * asset manifest and serves them cache-first, so a page load makes no asset
+ * requests at all.  Everything else, the login forms and anything carrying
+ * a request or service token in particular, is left to the network and never
+ * cached: only GETs for exactly the precached URLs, without a query string,
+ * are answered here.
+ *
+ * tools/build-theme fills in VERSION, from the hash of the manifest, and
+ * PRECACHE, the hashed asset URLs.  A deploy that changes any asset changes
+ * this file, so browsers install the new worker, which drops the old cache.
+ * In the source tree the list is empty and the worker does nothing.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+var VERSION = 'dev';
+var PRECACHE = [];
+
+var PREFIX = 'weblogin-assets-';
+var CACHE = PREFIX + VERSION;
+
+self.addEventListener('install', function (event) {
+	event.waitUntil(caches.open(CACHE).then(function (cache) {
+		return cache.addAll(PRECACHE);
+	}).then(function () {
+		return self.skipWaiting();
+	}));
+});
+
+self.addEventListener('activate', function (event) {
+	event.waitUntil(caches.keys().then(function (names) {
+		return Promise.all(names.filter(function (name) {
+			return name.indexOf(PREFIX) === 0 && name !== CACHE;
+		}).map(function (name) {
+			return caches.delete(name);
+		}));
+	}).then(function () {
+		return self.clients.claim();
+	}));
+});
+
+self.addEventListener('fetch', function (event) {
+	var request = event.request, url = new URL(request.url);
+	if (request.method !== 'GET' || url.origin !== self.location.origin
+	    || url.search || PRECACHE.indexOf(url.pathname) < 0) {
+		return;
+	}
+	event.respondWith(caches.open(CACHE).then(function (cache) {
+		return cache.match(url.pathname).then(function (cached) {
+			return cached || fetch(request).then(function (response) {
+				if (response.ok) {
+					cache.put(url.pathname, response.clone());
+				}
+				return response;
+			});
+		});
+	}));
+});
@@ -0,0 +1,245 @@
+# CSH::WebLogin::Cache -- Small TTL cache for per-user login state.
+#
+# A key/value cache with a time to live on every entry, kept in the worker
+# process by default.  Given a list of memcached servers, it is shared with
+# every worker on every weblogin host through memcached instead, using
+# Cache::Memcached::Fast or Cache::Memcached, whichever is installed, so that
+# it doesn't matter which worker a user's next request lands on.  Given a
+# directory instead, it is shared by every worker on this host through one
+# file per entry.  Values are plain Perl data structures.
+#
+# The in-process cache holds at most a fixed number of entries; when it is
+# full, expired entries are purged, and then the oldest.  Directory entries
+# are removed when they are found to have expired, and stale files are swept
+# out every so often.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Cache;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use Digest::SHA qw(sha1_hex);
+use Fcntl qw(O_CREAT O_EXCL O_WRONLY S_ISDIR);
+use File::Path qw(mkpath);
+use File::Spec;
+use Storable qw(nfreeze thaw);
+
+# The default time to live of an entry, in seconds.
+our $TTL = 300;
+
+# The most entries to keep in the in-process cache.
+our $MAX_ENTRIES = 1000;
+
+# Prefix for memcached keys, so that weblogin can share a memcached pool.
+our $NAMESPACE = 'weblogin:';
+
+# How often, in writes, a directory cache sweeps out stale files, and how
+# old in seconds a file has to be to count as stale.
+our $SWEEP_INTERVAL = 100;
+our $SWEEP_AGE = 3600;
+
+# Create a new cache.  Takes a hash of options: ttl, the default time to live
+# in seconds; servers, a reference to a list of memcached servers as
+# host:port; and dir, a directory to keep entries in if there are no
+# servers.  Dies if servers are given but no memcached client is installed,
+# or if the directory can't be created or isn't private to us.
+sub new {
+    my ($class, %args) = @_;
+    my $self = {
+        ttl     => $args{ttl} || $TTL,
+        entries => {},
+        writes  => 0,
+    };
+    if ($args{servers} && @{ $args{servers} }) {
+        my %options = (servers => $args{servers}, namespace => $NAMESPACE);
+        for my $module (qw(Cache::Memcached::Fast Cache::Memcached)) {
+            next unless eval "require $module; 1";
+            $self->{memcached} = $module->new (\%options);
+            last;
+        }
+        die "weblogin: memcached servers given but no memcached client\n"
+            unless $self->{memcached};
+    } elsif (defined $args{dir}) {
+        my $dir = $args{dir};
+        eval { mkpath ($dir, 0, 0700) } unless -d $dir;
+        die "weblogin: cannot create cache directory $dir\n" unless -d $dir;
+        check_private ($dir);
+        $self->{dir} = $dir;
+    }
+    return bless ($self, $class);
+}
+
+# Return a cache key built from the given parts, which may contain any
+# characters.  memcached keys can't contain spaces or control characters,
+# so anything unusual is escaped.
+sub key {
+    my ($self, @parts) = @_;
+    my @escaped = map {
+        my $part = defined ($_) ? $_ : '';
+        $part =~ s/([^\w.\@-])/sprintf ('%%%02X', ord $1)/ge;
+        $part;
+    } @parts;
+    return join (':', @escaped);
+}
+
+# Return the value stored under a key, or undef if there is none or it has
+# expired.
+sub get {
+    my ($self, $key) = @_;
+    return $self->{memcached}->get ($key) if $self->{memcached};
+    return $self->file_get ($key) if $self->{dir};
+    my $entry = $self->{entries}{$key} or return;
+    if ($entry->[0] <= time) {
+        delete $self->{entries}{$key};
+        return;
+    }
+    return $entry->[1];
+}
+
+# Store a value under a key for the given number of seconds, or the default
+# time to live.
+sub set {
+    my ($self, $key, $value, $ttl) = @_;
+    $ttl ||= $self->{ttl};
+    return $self->{memcached}->set ($key, $value, $ttl) if $self->{memcached};
+    return $self->file_set ($key, $value, $ttl) if $self->{dir};
+    $self->purge if keys %{ $self->{entries} } >= $MAX_ENTRIES;
+    $self->{entries}{$key} = [ time + $ttl, $value, time ];
+    return 1;
+}
+
+# Store a value under a key only if there is no unexpired value there yet.
+# Returns true if the value was stored.  With memcached or a directory, this
+# is atomic across every worker sharing the cache, so exactly one of several
+# concurrent callers wins.
+sub add {
+    my ($self, $key, $value, $ttl) = @_;
+    $ttl ||= $self->{ttl};
+    return $self->{memcached}->add ($key, $value, $ttl) if $self->{memcached};
+    return $self->file_add ($key, $value, $ttl) if $self->{dir};
+    return 0 if defined $self->get ($key);
+    return $self->set ($key, $value, $ttl);
+}
+
+# Remove a key.
+sub delete {
+    my ($self, $key) = @_;
+    return $self->{memcached}->delete ($key) if $self->{memcached};
+    if ($self->{dir}) {
+        unlink $self->file ($key);
+        return 1;
+    }
+    delete $self->{entries}{$key};
+    return 1;
+}
+
+##############################################################################
+# Directory storage
+##############################################################################
+
+# Entries are thawed with Storable and may hold login tokens, so refuse a
+# directory that anyone else could have created, replaced with a symlink,
+# read, or written to.
+sub check_private {
+    my ($dir) = @_;
+    my ($mode, $uid) = (lstat $dir)[2, 4];
+    if (!defined ($mode) || !S_ISDIR ($mode) || $uid != $<
+        || ($mode & 077)) {
+        die "weblogin: cache directory $dir must be a directory owned by"
+            . " uid $< with mode 0700\n";
+    }
+    return;
+}
+
+# Return the path of the file holding a key.
+sub file {
+    my ($self, $key) = @_;
+    return File::Spec->catfile ($self->{dir}, sha1_hex ($key));
+}
+
+# Read an entry from its file, removing it if it has expired.
+sub file_get {
+    my ($self, $key) = @_;
+    my $path = $self->file ($key);
+    open (my $fh, '<', $path) or return;
+    binmode $fh;
+    local $/;
+    my $data = <$fh>;
+    close $fh;
+    my $entry = eval { thaw ($data) };
+    if (!$entry || $entry->[0] <= time) {
+        unlink $path;
+        return;
+    }
+    return $entry->[1];
+}
+
+# Write an entry to a temporary file and rename it into place, so that
+# readers never see a partial entry.  The temporary file is created afresh,
+# never through an existing file or symlink.
+sub file_set {
+    my ($self, $key, $value, $ttl) = @_;
+    my $path = $self->file ($key);
+    my $temp = "$path.$$";
+    unlink $temp;
+    sysopen (my $fh, $temp, O_CREAT | O_EXCL | O_WRONLY, 0600) or return 0;
+    binmode $fh;
+    print {$fh} nfreeze ([ time + $ttl, $value ]);
+    close ($fh) or return 0;
+    rename ($temp, $path) or return 0;
+    $self->sweep;
+    return 1;
+}
+
+# Create an entry's file only if it doesn't already exist, replacing it if it
+# has expired.
+sub file_add {
+    my ($self, $key, $value, $ttl) = @_;
+    my $path = $self->file ($key);
+    return 0 if defined $self->file_get ($key);
+    sysopen (my $fh, $path, O_CREAT | O_EXCL | O_WRONLY, 0600) or return 0;
+    binmode $fh;
+    print {$fh} nfreeze ([ time + $ttl, $value ]);
+    close $fh;
+    $self->sweep;
+    return 1;
+}
+
+# Every so often, remove files that haven't been written for a long time.
+sub sweep {
+    my ($self) = @_;
+    return if ++$self->{writes} % $SWEEP_INTERVAL;
+    opendir (my $dir, $self->{dir}) or return;
+    my $cutoff = time - $SWEEP_AGE;
+    for my $name (grep { /^[0-9a-f]{40}\z/ } readdir $dir) {
+        my $path = File::Spec->catfile ($self->{dir}, $name);
+        my $mtime = (stat $path)[9];
+        unlink $path if defined ($mtime) && $mtime < $cutoff;
+    }
+    closedir $dir;
+    return;
+}
+
+# Make room in the in-process cache by dropping expired entries and then,
+# if that wasn't enough, the oldest tenth of the rest.
+sub purge {
+    my ($self) = @_;
+    my $entries = $self->{entries};
+    my $now = time;
+    for my $key (keys %$entries) {
+        delete $entries->{$key} if $entries->{$key}[0] <= $now;
+    }
+    my $excess = keys (%$entries) - $MAX_ENTRIES * 0.9;
+    if ($excess > 0) {
+        my @oldest = sort { $entries->{$a}[2] <=> $entries->{$b}[2] }
+            keys %$entries;
+        delete @$entries{ @oldest[0 .. $excess - 1] };
+    }
+    return;
+}
+
+1;
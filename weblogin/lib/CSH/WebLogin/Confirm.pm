@@ -0,0 +1,54 @@
+# CSH::WebLogin::Confirm -- Skip the confirmation page when it says nothing.
+#
+# After a successful login, WebLogin renders confirm.tmpl, which for most
+# logins shows nothing but a Continue button linking to the return URL.
+# That costs the user a page render and a click before reaching the site
+# they asked for.  Installed, this sends a 303 redirect to the return URL
+# in its place, with the same WebAuth cookies, unless the page has
+# something to show: a REMOTE_USER choice, a password expiration warning,
+# or a message from the user information service.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Confirm;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use CSH::WebLogin::Wrap qw(wrap_tt_process);
+
+# Template parameters that, if set, mean the confirmation page has to be
+# shown.
+our @SHOW = qw(show_remuser warn_expire user_message);
+
+# Return true if the confirmation page with these parameters can be replaced
+# by a redirect.
+sub skippable {
+    my ($params) = @_;
+    return 0 unless ref ($params) eq 'HASH';
+    return 0 if grep { $params->{$_} } @SHOW;
+    my $url = $params->{return_url};
+    return defined ($url) && $url =~ m{^https?://}i;
+}
+
+# Make the given WebLogin object redirect instead of rendering $template,
+# the name of the confirmation page template, whenever it can.
+sub install {
+    my ($class, $weblogin, $template) = @_;
+    wrap_tt_process ($weblogin, sub {
+        my ($process, @args) = @_;
+        my ($app, $name, $params) = @args;
+        if (defined ($name) && $name eq $template && skippable ($params)) {
+            $app->header_type ('redirect');
+            $app->header_add (-location => $params->{return_url},
+                              -status   => '303 See Other');
+            return '';
+        }
+        return $process->(@args);
+    });
+    return;
+}
+
+1;
@@ -0,0 +1,191 @@
+# CSH::WebLogin::KeepAlive -- Persistent WebKDC connections for workers.
+#
+# WebKDC creates a new LWP::UserAgent for every call it makes, so every
+# login POST pays for a fresh TCP connection and TLS handshake to the
+# WebKDC, even though the worker making it lives for thousands of requests.
+# Installed, this hands WebKDC the same keep-alive user agent every time
+# instead, one per worker process, so that connections to the WebKDC stay
+# open between requests.  TLS sessions are cached as well, so that even a
+# new connection can usually resume rather than repeat the full handshake.
+#
+# Before each call, connections that the WebKDC has closed are dropped, as
+# are connections idle for longer than the idle timeout, which should stay
+# below the WebKDC's own keep-alive timeout so that we never send a request
+# on a connection it is about to close.
+#
+# A new worker can also open its connection before accepting its first
+# request, so that the first user it serves doesn't wait for the handshakes.
+#
+# Each new connection is counted with the request timer, so the metrics can
+# report how often calls reuse a connection.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::KeepAlive;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use CSH::WebLogin::Wrap qw(wrap_function wrap_webkdc_requests);
+use Data::Dumper ();
+
+# Connections idle for longer than this many seconds are closed rather than
+# reused.  Apache's default KeepAliveTimeout on the WebKDC is 5 seconds.
+our $IDLE_TIMEOUT = 4;
+
+# The most connections to keep open per worker.
+our $MAX_CONNECTIONS = 2;
+
+# The number of TLS sessions to remember for resumption.
+our $SESSION_CACHE_SIZE = 16;
+
+# Options to LWP::UserAgent->new that are ours to decide and ignored when
+# WebKDC passes them, and those that can't be changed on an existing agent,
+# so that passing them with a new value means building a new one.
+our %IGNORE = map { $_ => 1 } qw(conn_cache keep_alive);
+our %REBUILD = map { $_ => 1 } qw(proxy);
+
+# Set while a WebKDC request function is running, which is when creating a
+# user agent returns the shared one.
+our $ACTIVE = 0;
+
+# Create a new pool and install it into the WebKDC request functions.  Takes
+# a hash of options: timing, the CSH::WebLogin::Timing object to count new
+# connections with; idle_timeout, overriding $IDLE_TIMEOUT; and timeout, the
+# LWP timeout in seconds for each WebKDC call, if not LWP's default.  Does
+# nothing and returns undef if LWP isn't available.
+sub new {
+    my ($class, %args) = @_;
+    return unless eval { require LWP::UserAgent; 1 };
+    my $self = {
+        timing       => $args{timing},
+        idle_timeout => $args{idle_timeout} || $IDLE_TIMEOUT,
+        timeout      => $args{timeout},
+        pid          => 0,
+    };
+    bless ($self, $class);
+    $self->install;
+    return $self;
+}
+
+# Return a string representing an option value, for comparison.
+sub serialize {
+    my ($value) = @_;
+    local $Data::Dumper::Indent = 0;
+    local $Data::Dumper::Sortkeys = 1;
+    local $Data::Dumper::Terse = 1;
+    return Data::Dumper::Dumper ($value);
+}
+
+# Apply the options WebKDC passed to LWP::UserAgent->new to an existing
+# agent, built with the options in $built, through their accessors.
+# Returns false if one of them can't be applied that way.
+sub configure {
+    my ($agent, $built, %args) = @_;
+    for my $option (sort keys %args) {
+        my $value = $args{$option};
+        next if $IGNORE{$option};
+        if ($option eq 'ssl_opts' && ref ($value) eq 'HASH') {
+            $agent->ssl_opts ($_ => $value->{$_}) for keys %$value;
+        } elsif ($option eq 'env_proxy') {
+            $agent->env_proxy if $value;
+        } elsif ($REBUILD{$option}) {
+            return 0 unless exists $built->{$option}
+                && serialize ($value) eq serialize ($built->{$option});
+        } elsif (!$agent->can ($option)) {
+            return 0;
+        } else {
+            $agent->$option ($value);
+        }
+    }
+    return 1;
+}
+
+# Return the user agent for this process, creating it the first time it's
+# needed in each worker, since connections can't be shared across a fork.
+# Any options WebKDC passes to LWP::UserAgent->new are applied to it on
+# every call, so the agent opened early by connect() ends up configured just
+# as WebKDC asks; options that can't be applied to an existing agent get a
+# new one built with them.
+sub agent {
+    my ($self, $new, @args) = @_;
+    my $agent = $self->{pid} == $$ ? $self->{agent} : undef;
+    if ($agent && !configure ($agent, $self->{built}, @args)) {
+        $agent->conn_cache->drop;
+        undef $agent;
+    }
+    if (!$agent) {
+        my %args = @args;
+        delete $args{$_} for keys %IGNORE;
+        $agent = $new->('LWP::UserAgent', %args,
+                        keep_alive => $MAX_CONNECTIONS);
+        if (eval { require IO::Socket::SSL; 1 }) {
+            my $sessions
+                = IO::Socket::SSL::Session_Cache->new ($SESSION_CACHE_SIZE);
+            $agent->ssl_opts (SSL_session_cache => $sessions);
+        }
+        $self->{agent} = $agent;
+        $self->{pid} = $$;
+        $self->{built} = \%args;
+    }
+    $agent->timeout ($self->{timeout}) if $self->{timeout};
+    my $cache = $self->{agent}->conn_cache;
+    $cache->prune;
+    $cache->drop ($self->{idle_timeout}, 'idle');
+    return $self->{agent};
+}
+
+# Close every open connection, for when a call was interrupted partway and
+# the state of its connection is unknown.
+sub reset {
+    my ($self) = @_;
+    return unless $self->{agent} && $self->{pid} == $$;
+    $self->{agent}->conn_cache->drop;
+    return;
+}
+
+# Open a connection to the WebKDC at the given URL, normally
+# $WebKDC::Config::URL, with a HEAD request, and leave it in the pool for the
+# first real call.  Returns true if the WebKDC answered at all, whatever the
+# status of the answer.
+sub connect {
+    my ($self, $url) = @_;
+    return 0 unless defined ($url) && $self->{new};
+    local $ACTIVE = 1;
+    my $response = $self->agent ($self->{new})->head ($url);
+    my $warning = $response->header ('Client-Warning');
+    return !(defined ($warning) && $warning eq 'Internal response');
+}
+
+# Wrap the WebKDC request functions so that while they run, creating a user
+# agent returns ours, and wrap LWP's socket creation to count connections.
+# Other users of LWP in the process are unaffected.
+sub install {
+    my ($self) = @_;
+    $self->{new} = \&LWP::UserAgent::new;
+    wrap_function ('LWP::UserAgent::new', sub {
+        my ($new, $class, @args) = @_;
+        return $new->($class, @args)
+            unless $ACTIVE && $class eq 'LWP::UserAgent';
+        return $self->agent ($new, @args);
+    });
+    wrap_webkdc_requests (sub {
+        my ($original, @args) = @_;
+        local $ACTIVE = 1;
+        return $original->(@args);
+    });
+    if (eval { require LWP::Protocol::http; 1 }) {
+        wrap_function ('LWP::Protocol::http::_new_socket', sub {
+            my ($socket, @args) = @_;
+            if ($ACTIVE && $self->{timing}) {
+                $self->{timing}->count ('webkdc_connects');
+            }
+            return $socket->(@args);
+        });
+    }
+    return;
+}
+
+1;
@@ -0,0 +1,48 @@
+# CSH::WebLogin::Lite -- Decide which requests get the lite template set.
+#
+# Weak browsers (game consoles, e-readers, feature phones, text browsers)
+# get the plain pages in templates/lite instead of the full theme.  The
+# choice is made from the User-Agent, unless the request carries an
+# explicit lite=1 or lite=0, which the lite pages' forms pass along.
+#
+# The driver uses this to pick the template include path for each request,
+# and tools/build-theme uses the same browser patterns to keep the Early
+# Hints for the full theme's stylesheet away from lite clients.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Lite;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+# User-Agent patterns of browsers that get the lite template set by default.
+our @BROWSERS = (
+    qr/\b(?:Kindle|Silk|Nook)\b/,
+    qr/\b(?:Xbox|PlayStation|Nintendo|WiiU|Wii)\b/,
+    qr/\b(?:Opera Mini|NetFront|BlackBerry|Series40|KAIOS|Nokia)/i,
+    qr/\bMSIE [2-8]\./,
+    qr/^(?:Lynx|Links|ELinks|w3m)\b/i,
+);
+
+# Return true if a User-Agent string is one of the lite browsers.
+sub browser {
+    my ($class, $agent) = @_;
+    return 0 unless defined $agent;
+    return (grep { $agent =~ $_ } @BROWSERS) ? 1 : 0;
+}
+
+# Given a CGI query, return whether it should get the lite template set and
+# the explicit choice it carried, if any, as 1 or 0.
+sub request {
+    my ($class, $q) = @_;
+    my $flag = $q->param ('lite');
+    if (defined ($flag) && $flag =~ /^[01]\z/) {
+        return ($flag, $flag);
+    }
+    return ($class->browser ($q->user_agent));
+}
+
+1;
@@ -0,0 +1,291 @@
+# CSH::WebLogin::Metrics -- Prometheus metrics for the worker pool.
+#
+# Each worker of the standalone FastCGI server reports every request it
+# finishes to the manager over the status pipe, as a summary from
+# CSH::WebLogin::Timing.  The manager adds them up here and serves the
+# totals in the Prometheus text format on a separate metrics socket, so that
+# one scrape covers the whole pool and the metrics are never reachable
+# through the public login URLs.
+#
+# The metrics are request counts and latency histograms per run mode, error
+# counts by the template error flag that was set (err_loginfailed,
+# err_cookies_disabled, and so on), WebKDC call latency and how many calls
+# had to open a new connection, the number of starting, busy, idle,
+# retiring, and draining workers (the old generation during a rolling
+# restart) and how long new ones took to become ready, and how many
+# OTP send requests were coalesced with an earlier one instead of reaching
+# the WebKDC.  Alert on busy workers approaching the pool size to catch
+# saturation before logins start timing out.
+#
+# Real-user measurements from the optional beacon in the page layout are
+# kept here too: time to first byte, first contentful paint, and largest
+# contentful paint, and the bytes transferred, per page template.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Metrics;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+# Upper bounds of the latency histogram buckets, in seconds.
+our @BUCKETS = (0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10);
+
+# Upper bounds of the buckets for browser timings, in seconds, and for the
+# bytes a page load transferred.
+our @RUM_BUCKETS = (0.1, 0.25, 0.5, 1, 2, 4, 8, 16, 30);
+our @BYTE_BUCKETS = (10_000, 30_000, 100_000, 300_000, 1_000_000, 3_000_000);
+
+# Upper bounds of the buckets for worker startup times, in seconds.
+our @STARTUP_BUCKETS = (0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30);
+
+# The browser timings reported by the beacon, in milliseconds.
+our @RUM_TIMINGS = qw(ttfb fcp lcp);
+
+# Create a new, empty set of metrics.
+sub new {
+    my ($class) = @_;
+    my $self = {
+        requests  => {},
+        errors    => {},
+        webkdc    => new_histogram (),
+        calls     => 0,
+        connects  => 0,
+        coalesced => 0,
+        started   => 0,
+        killed    => 0,
+        timeouts  => 0,
+        startup   => new_histogram (\@STARTUP_BUCKETS),
+        rum       => {},
+        rum_bytes => {},
+    };
+    return bless ($self, $class);
+}
+
+# Return a new, empty histogram with the given bucket bounds, defaulting to
+# the latency buckets.
+sub new_histogram {
+    my ($bounds) = @_;
+    $bounds ||= \@BUCKETS;
+    return { bounds => $bounds, buckets => [ (0) x @$bounds ], sum => 0,
+             count => 0 };
+}
+
+# Add an observation to a histogram.
+sub observe {
+    my ($histogram, $value) = @_;
+    my $bounds = $histogram->{bounds};
+    for my $i (0 .. $#$bounds) {
+        $histogram->{buckets}[$i]++ if $value <= $bounds->[$i];
+    }
+    $histogram->{sum} += $value;
+    $histogram->{count}++;
+    return;
+}
+
+# Record a finished request from the summary a worker sent, a string of
+# space-separated key=value pairs as produced by CSH::WebLogin::Timing.
+sub record {
+    my ($self, $summary) = @_;
+    my %request = map { split (/=/, $_, 2) } grep { /=/ } split (' ', $summary);
+    my $rm = defined ($request{rm}) ? $request{rm} : '-';
+    $self->{requests}{$rm} ||= new_histogram ();
+    observe ($self->{requests}{$rm}, ($request{total} || 0) / 1000);
+    if ($request{webkdc_calls}) {
+        observe ($self->{webkdc}, ($request{webkdc} || 0) / 1000);
+        $self->{calls} += $request{webkdc_calls};
+        $self->{connects} += $request{webkdc_connects} || 0;
+    }
+    $self->{coalesced} += $request{sendauth_coalesced} || 0;
+    $self->{timeouts} += $request{timeouts} || 0;
+    if ($request{errors}) {
+        $self->{errors}{$_}++ for split (/,/, $request{errors});
+    }
+    return;
+}
+
+# Record a beacon from a browser, a string of space-separated key=value pairs
+# with the page template, the browser timings in milliseconds, and the bytes
+# transferred.  The driver has already checked the values.
+sub record_rum {
+    my ($self, $beacon) = @_;
+    my %beacon = map { split (/=/, $_, 2) } grep { /=/ } split (' ', $beacon);
+    my $page = $beacon{page};
+    return unless defined $page;
+    for my $timing (@RUM_TIMINGS) {
+        next unless defined $beacon{$timing};
+        my $histogram = $self->{rum}{$page}{$timing}
+            ||= new_histogram (\@RUM_BUCKETS);
+        observe ($histogram, $beacon{$timing} / 1000);
+    }
+    if (defined $beacon{bytes}) {
+        $self->{rum_bytes}{$page} ||= new_histogram (\@BYTE_BUCKETS);
+        observe ($self->{rum_bytes}{$page}, $beacon{bytes});
+    }
+    return;
+}
+
+# Return the fraction of WebKDC calls that reused a connection.
+sub reuse_ratio {
+    my ($self) = @_;
+    return 0 unless $self->{calls};
+    my $reused = $self->{calls} - $self->{connects};
+    $reused = 0 if $reused < 0;
+    return sprintf ('%.4f', $reused / $self->{calls});
+}
+
+# Record that a worker process was started.
+sub worker_started {
+    my ($self) = @_;
+    $self->{started}++;
+    return;
+}
+
+# Record that a worker was killed for being stuck on a request.
+sub worker_killed {
+    my ($self) = @_;
+    $self->{killed}++;
+    return;
+}
+
+# Record that a worker process became ready to serve requests, the given
+# number of seconds after it was started.
+sub worker_ready {
+    my ($self, $seconds) = @_;
+    observe ($self->{startup}, $seconds);
+    return;
+}
+
+# Escape a label value for the text format.
+sub label {
+    my ($value) = @_;
+    $value =~ s/([\\"])/\\$1/g;
+    $value =~ s/\n/\\n/g;
+    return $value;
+}
+
+# Return the lines for a histogram with the given name and label string.
+sub histogram_lines {
+    my ($name, $labels, $histogram) = @_;
+    my $prefix = $labels ? "$labels," : '';
+    my $bounds = $histogram->{bounds};
+    my @lines;
+    for my $i (0 .. $#$bounds) {
+        push (@lines, "${name}_bucket{${prefix}le=\"$bounds->[$i]\"}"
+                    . " $histogram->{buckets}[$i]");
+    }
+    push (@lines, "${name}_bucket{${prefix}le=\"+Inf\"} $histogram->{count}");
+    my $suffix = $labels ? "{$labels}" : '';
+    push (@lines, "${name}_sum$suffix " . sprintf ('%.6f', $histogram->{sum}));
+    push (@lines, "${name}_count$suffix $histogram->{count}");
+    return @lines;
+}
+
+# Return the metrics in the Prometheus text format.  Takes a hash of the
+# current worker counts by state (starting, busy, idle, retiring, and
+# draining), the configured pool size, and the size it may grow to.
+sub render {
+    my ($self, %workers) = @_;
+    my $pool = delete $workers{pool};
+    my $max = delete $workers{max};
+    $max = $pool unless defined $max;
+    my @lines;
+
+    push (@lines,
+          '# HELP weblogin_request_duration_seconds Time to handle a'
+          . ' request, by run mode.',
+          '# TYPE weblogin_request_duration_seconds histogram');
+    for my $rm (sort keys %{ $self->{requests} }) {
+        push (@lines, histogram_lines ('weblogin_request_duration_seconds',
+                                       'rm="' . label ($rm) . '"',
+                                       $self->{requests}{$rm}));
+    }
+
+    push (@lines,
+          '# HELP weblogin_errors_total Pages rendered with an error flag'
+          . ' set, by flag.',
+          '# TYPE weblogin_errors_total counter');
+    for my $flag (sort keys %{ $self->{errors} }) {
+        push (@lines, 'weblogin_errors_total{flag="' . label ($flag) . '"} '
+                    . $self->{errors}{$flag});
+    }
+
+    push (@lines,
+          '# HELP weblogin_webkdc_duration_seconds Time spent in WebKDC'
+          . ' calls per request that made any.',
+          '# TYPE weblogin_webkdc_duration_seconds histogram',
+          histogram_lines ('weblogin_webkdc_duration_seconds', '',
+                           $self->{webkdc}),
+          '# HELP weblogin_webkdc_calls_total Calls made to the WebKDC.',
+          '# TYPE weblogin_webkdc_calls_total counter',
+          "weblogin_webkdc_calls_total $self->{calls}",
+          '# HELP weblogin_webkdc_connections_total Connections opened to'
+          . ' the WebKDC.',
+          '# TYPE weblogin_webkdc_connections_total counter',
+          "weblogin_webkdc_connections_total $self->{connects}",
+          '# HELP weblogin_webkdc_connection_reuse_ratio Fraction of WebKDC'
+          . ' calls that reused an open connection.',
+          '# TYPE weblogin_webkdc_connection_reuse_ratio gauge',
+          'weblogin_webkdc_connection_reuse_ratio ' . $self->reuse_ratio,
+          '# HELP weblogin_sendauth_coalesced_total OTP send requests answered'
+          . ' from an earlier send.',
+          '# TYPE weblogin_sendauth_coalesced_total counter',
+          "weblogin_sendauth_coalesced_total $self->{coalesced}");
+
+    push (@lines,
+          '# HELP weblogin_rum_seconds Browser-reported page load timings,'
+          . ' by page and timing.',
+          '# TYPE weblogin_rum_seconds histogram');
+    for my $page (sort keys %{ $self->{rum} }) {
+        for my $timing (@RUM_TIMINGS) {
+            my $histogram = $self->{rum}{$page}{$timing} or next;
+            my $labels = 'page="' . label ($page) . "\",timing=\"$timing\"";
+            push (@lines, histogram_lines ('weblogin_rum_seconds', $labels,
+                                           $histogram));
+        }
+    }
+    push (@lines,
+          '# HELP weblogin_rum_bytes Browser-reported bytes transferred per'
+          . ' page load, by page.',
+          '# TYPE weblogin_rum_bytes histogram');
+    for my $page (sort keys %{ $self->{rum_bytes} }) {
+        push (@lines, histogram_lines ('weblogin_rum_bytes',
+                                       'page="' . label ($page) . '"',
+                                       $self->{rum_bytes}{$page}));
+    }
+
+    push (@lines,
+          '# HELP weblogin_workers Worker processes, by state.',
+          '# TYPE weblogin_workers gauge');
+    for my $state (sort keys %workers) {
+        push (@lines, "weblogin_workers{state=\"$state\"} $workers{$state}");
+    }
+    push (@lines,
+          '# HELP weblogin_workers_configured Configured worker pool size.',
+          '# TYPE weblogin_workers_configured gauge',
+          "weblogin_workers_configured $pool",
+          '# HELP weblogin_workers_max Size the worker pool may grow to.',
+          '# TYPE weblogin_workers_max gauge',
+          "weblogin_workers_max $max",
+          '# HELP weblogin_workers_started_total Worker processes started.',
+          '# TYPE weblogin_workers_started_total counter',
+          "weblogin_workers_started_total $self->{started}",
+          '# HELP weblogin_workers_killed_total Workers killed for exceeding'
+          . ' the request timeout.',
+          '# TYPE weblogin_workers_killed_total counter',
+          "weblogin_workers_killed_total $self->{killed}",
+          '# HELP weblogin_request_timeouts_total Requests abandoned at the'
+          . ' request timeout.',
+          '# TYPE weblogin_request_timeouts_total counter',
+          "weblogin_request_timeouts_total $self->{timeouts}",
+          '# HELP weblogin_worker_startup_seconds Time from starting a worker'
+          . ' to it being ready for requests.',
+          '# TYPE weblogin_worker_startup_seconds histogram',
+          histogram_lines ('weblogin_worker_startup_seconds', '',
+                           $self->{startup}));
+    return join ("\n", @lines) . "\n";
+}
+
+1;
@@ -0,0 +1,169 @@
+# CSH::WebLogin::SendAuth -- Coalesce repeated requests to send an OTP.
+#
+# The Send OTP button on the multifactor page posts rm=multifactor_sendauth,
+# and every post makes the WebKDC send the user another code by SMS or
+# voice.  Users on slow phones tap it again and again, and during an outage
+# everyone does, so the backend sees several sends per user just when it can
+# least afford them.
+#
+# Installed, this wraps WebLogin's multifactor_sendauth run mode.  The first
+# request for a given request token and username within a short window runs
+# it as usual and remembers the parameters the multifactor page was rendered
+# with.  Any other request for the same login in that window, whether it
+# arrives while the first is still waiting on the WebKDC or after it, sends
+# nothing: it waits for the first to finish and renders the same page, with
+# multifactor_sentauth set.  If the first request fails without rendering the
+# page, the next one tries the send again.
+#
+# The window is kept in a CSH::WebLogin::Cache, which must be shared by all
+# the workers that can receive a user's requests, through memcached or a
+# directory on the local host, for concurrent taps to be coalesced.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::SendAuth;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use CSH::WebLogin::Wrap qw(wrap_tt_process);
+use Digest::SHA qw(sha256_hex);
+use Time::HiRes qw(sleep time);
+
+# How long after a send, in seconds, further sends for the same login are
+# coalesced with it.
+our $WINDOW = 30;
+
+# How long, in seconds, a duplicate request waits for the first one to finish
+# before giving up and sending again, and how often it checks.
+our $WAIT = 10;
+our $POLL = 0.2;
+
+# The name of the run mode to coalesce.
+our $RUN_MODE = 'multifactor_sendauth';
+
+# Set while the wrapped run mode is running, to the object that should
+# receive the parameters of the multifactor page when it is rendered.
+our $CAPTURE;
+
+# Create a new coalescer and install it into a WebLogin object.  Takes the
+# WebLogin object and a hash of options: cache, the CSH::WebLogin::Cache to
+# keep the window in; pages, the driver's hash of page templates; and timing,
+# the CSH::WebLogin::Timing object to count coalesced requests with.  Returns
+# undef and does nothing if WebLogin has no sendauth run mode.
+sub new {
+    my ($class, $weblogin, %args) = @_;
+    my %modes = $weblogin->run_modes;
+    my $handler = $modes{$RUN_MODE} or return;
+    my $self = {
+        cache       => $args{cache},
+        multifactor => $args{pages}{multifactor},
+        timing      => $args{timing},
+        handler     => $handler,
+    };
+    bless ($self, $class);
+    $self->install ($weblogin);
+    return $self;
+}
+
+# Return the cache key for a request, or undef if it doesn't identify a
+# login.  The request token is long, so it is hashed.
+sub request_key {
+    my ($self, $q) = @_;
+    my $rt = $q->param ('RT');
+    my $username = $q->param ('username');
+    return unless defined ($rt) && length ($rt) && defined $username;
+    my $cache = $self->{cache};
+    return $cache->key ('sendauth', sha256_hex ($rt), $username);
+}
+
+# Return a copy of template parameters that can be stored in the cache:
+# plain values, arrays, and hashes only.
+sub storable_params {
+    my ($params) = @_;
+    my %copy;
+    for my $name (keys %$params) {
+        my $value = $params->{$name};
+        my $type = ref $value;
+        next if $type && $type ne 'ARRAY' && $type ne 'HASH';
+        $copy{$name} = $value;
+    }
+    return \%copy;
+}
+
+# Run the real sendauth run mode, recording the multifactor page parameters
+# it renders with.  If it fails, renders some other page, or renders the page
+# with an error, forget the send so that the next request tries again.
+sub sendauth {
+    my ($self, $app, $key) = @_;
+    my $handler = $self->{handler};
+    my $capture = {};
+    my $output = eval {
+        local $CAPTURE = $capture;
+        ref ($handler) ? $handler->($app) : $app->$handler ();
+    };
+    my $error = $@;
+    if (defined $key) {
+        my $cache = $self->{cache};
+        if ($capture->{params}) {
+            $cache->set ($key, { params => $capture->{params} }, $WINDOW);
+        } else {
+            $cache->delete ($key);
+        }
+    }
+    die $error if $error;
+    return $output;
+}
+
+# Handle a request that another one already sent for: wait until the first
+# has rendered its page and render it again.  Returns undef if the first
+# request failed or didn't finish in time.
+sub replay {
+    my ($self, $app, $key) = @_;
+    my $cache = $self->{cache};
+    my $deadline = time + $WAIT;
+    while (1) {
+        my $entry = $cache->get ($key) or return;
+        if ($entry->{params}) {
+            $self->{timing}->count ('sendauth_coalesced') if $self->{timing};
+            my %params = %{ $entry->{params} };
+            return $app->tt_process ($self->{multifactor}, \%params);
+        }
+        return if time >= $deadline;
+        sleep $POLL;
+    }
+}
+
+# Replace the sendauth run mode with one that coalesces duplicates, and wrap
+# the template processing to capture the page the real one renders.
+sub install {
+    my ($self, $weblogin) = @_;
+    $weblogin->run_modes ($RUN_MODE => sub {
+        my ($app) = @_;
+        my $key = $self->request_key ($app->query);
+        return $self->sendauth ($app, $key) unless defined $key;
+        my $cache = $self->{cache};
+        for (1 .. 2) {
+            return $self->sendauth ($app, $key)
+                if $cache->add ($key, { pid => $$ }, $WINDOW);
+            my $output = $self->replay ($app, $key);
+            return $output if defined $output;
+        }
+        return $self->sendauth ($app, $key);
+    });
+    wrap_tt_process ($weblogin, sub {
+        my ($process, @args) = @_;
+        my ($app, $name, $params) = @args;
+        if ($CAPTURE && defined ($name) && $name eq $self->{multifactor}
+            && ref ($params) eq 'HASH'
+            && !grep { /^err_/ && $params->{$_} } keys %$params) {
+            $CAPTURE->{params} = storable_params ($params);
+        }
+        return $process->(@args);
+    });
+    return;
+}
+
+1;
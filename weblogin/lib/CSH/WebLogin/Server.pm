@@ -0,0 +1,620 @@
+# CSH::WebLogin::Server -- Preforked FastCGI worker pool for the driver.
+#
+# When weblogin.fcgi is started as its own FastCGI server rather than by
+# Apache, this module opens the listening socket and forks a fixed number of
+# worker processes that all accept requests from that one socket.
+# Everything the driver loaded before calling run(), including WebLogin and
+# its templates, is shared copy-on-write by the workers.  Workers that exit,
+# for whatever reason, are replaced.
+#
+# On SIGHUP, or when a watched file changes, the server does a rolling
+# restart.  It first checks that the driver as now on disk compiles, and
+# keeps running as it is if not.  Then it re-executes the driver in place,
+# keeping its process ID, and passes on the listening socket, the status
+# pipe, and the list of its workers.  Those workers stay its children and
+# keep accepting requests while the new driver loads, prewarms, and starts
+# a new generation of workers.  Only once every new worker has reported
+# ready are the old ones told to exit, after finishing any request they are
+# in the middle of, so a deploy never leaves the socket without workers.
+#
+# Workers can also be limited to a number of requests or a resident memory
+# size, after which they exit between requests.  A retiring worker tells the
+# manager over a status pipe first, and the manager forks its replacement
+# from its own already-loaded state right away, so the pool never runs short
+# and no request waits on a cold process.
+#
+# A new worker warms itself up (the driver opens its WebKDC connection, for
+# instance) before it accepts anything from the shared socket, so a cold
+# worker never gets a request, and then tells the manager it is ready.  The
+# manager counts workers that haven't yet as starting rather than idle and
+# keeps a histogram of how long workers take to become ready.
+#
+# The pool can also grow.  Given a maximum above the configured size, the
+# manager forks another worker whenever every worker is busy, so that a few
+# requests stuck on a slow WebKDC or password change don't leave the rest
+# queueing, and retires the extras again once they have sat idle for a
+# while.  Extra workers are forked from the prewarmed manager and share most
+# of its memory, so they are cheap.  Given a request timeout, the manager
+# also kills any worker that has been busy for longer than that plus a grace
+# period, for calls stuck where the driver's own timeout can't interrupt
+# them; the pool replaces it as usual.
+#
+# Workers also tell the manager when they start and finish each request,
+# passing a summary of the finished request, and the manager keeps the
+# metrics from those in CSH::WebLogin::Metrics.  Given a metrics address, it
+# serves them to Prometheus, along with the busy and idle worker counts.
+#
+# Without a listen address, run() just calls the handler in the current
+# process, which is what we want under mod_fcgid or plain CGI.  There is no
+# manager to watch for deploys then, so, as stock WebLogin does, the process
+# exits after any request once the script it was started as has changed,
+# and the process manager starts a fresh one.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Server;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use CGI::Fast;
+use CSH::WebLogin::Metrics;
+use CSH::WebLogin::Watcher;
+use FCGI;
+use Fcntl qw(F_GETFD F_SETFD FD_CLOEXEC);
+use IO::Handle;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use POSIX qw(WNOHANG);
+use Time::HiRes ();
+
+# The listen queue size for the FastCGI socket.
+our $BACKLOG = 128;
+
+# Environment variable used to pass the listening socket across a reload.
+our $LISTEN_FD_ENV = 'WEBLOGIN_LISTEN_FD';
+
+# Environment variables used to pass the status pipe and the process IDs of
+# the old generation of workers across a reload.
+our $STATUS_FD_ENV   = 'WEBLOGIN_STATUS_FD';
+our $OLD_WORKERS_ENV = 'WEBLOGIN_OLD_WORKERS';
+
+# How long, in seconds, to wait for a new generation of workers to become
+# ready before warning that the old one is still serving.
+our $HANDOFF_WARN = 60;
+
+# How often, in requests, a worker with a memory limit checks its size.
+our $RSS_INTERVAL = 10;
+
+# Request limits are spread randomly by up to this fraction so that workers
+# started together don't all retire at once.
+our $REQUEST_JITTER = 0.1;
+
+# How often, in seconds, the manager checks watched files for changes.
+our $WATCH_INTERVAL = 1;
+
+# How long, in seconds, an extra worker above the configured pool size has
+# to be idle before it is retired.
+our $SPARE_TIMEOUT = 30;
+
+# How long, in seconds, past the request timeout a busy worker is given
+# before the manager kills it.
+our $KILL_GRACE = 5;
+
+# How long, in seconds, to wait for a metrics scrape to send its request.
+our $METRICS_TIMEOUT = 2;
+
+# Return the number of CPUs on this system, used as the default pool size.
+sub cpu_count {
+    my $count = 0;
+    if (open (my $cpuinfo, '<', '/proc/cpuinfo')) {
+        $count = grep { /^processor\s*:/ } <$cpuinfo>;
+        close $cpuinfo;
+    }
+    return $count || 4;
+}
+
+# Create a new server.  Takes a hash of options: listen, the socket path or
+# host:port to listen on; workers, the number of worker processes to run
+# (defaulting to the number of CPUs); watch, a reference to a list of files
+# and directories whose modification triggers a reload; argv, the original
+# command-line arguments, used to re-execute the driver; max_requests, the
+# number of requests after which a worker retires; and max_rss, the resident
+# size in bytes above which a worker retires.  Zero or unset means no limit.
+# metrics is the socket path or host:port to serve metrics on, if any.
+# max_workers is the size the pool may grow to when every worker is busy,
+# defaulting to workers, and timeout is the request timeout in seconds,
+# after which a busy worker is killed.
+sub new {
+    my ($class, %args) = @_;
+    my $self = {
+        listen       => $args{listen},
+        metrics_addr => $args{metrics},
+        workers      => $args{workers} || cpu_count (),
+        max_workers  => $args{max_workers} || 0,
+        timeout      => $args{timeout} || 0,
+        watch        => $args{watch} || [],
+        argv         => $args{argv} || [],
+        max_requests => $args{max_requests} || 0,
+        max_rss      => $args{max_rss} || 0,
+        requests     => 0,
+        children     => {},
+        retiring     => {},
+        busy         => {},
+        ready        => {},
+        idle_since   => {},
+        old          => {},
+        metrics      => CSH::WebLogin::Metrics->new,
+        status       => '',
+        stopping     => 0,
+        reloading    => 0,
+    };
+    if ($self->{max_workers} < $self->{workers}) {
+        $self->{max_workers} = $self->{workers};
+    }
+    if ($self->{max_requests}) {
+        my $jitter = $self->{max_requests} * $REQUEST_JITTER;
+        $self->{max_requests} += int (rand ($jitter + 1));
+    }
+    return bless ($self, $class);
+}
+
+# Return the resident set size of the current process in bytes, or 0 if it
+# can't be determined.
+sub rss {
+    open (my $statm, '<', '/proc/self/statm') or return 0;
+    my ($size, $resident) = split (' ', scalar <$statm>);
+    close $statm;
+    return ($resident || 0) * POSIX::sysconf (POSIX::_SC_PAGESIZE ());
+}
+
+# Create the FastCGI request object that CGI::Fast accepts connections
+# with, listening on the given socket or on the one we were started with.
+sub new_request {
+    my ($self, $socket) = @_;
+    my @socket = defined ($socket) ? ($socket) : ();
+    my $request = FCGI::Request (\*STDIN, \*STDOUT, \*STDERR, \%ENV, @socket);
+    return bless ($request, 'CSH::WebLogin::Server::Request');
+}
+
+# Return the time at which the current request's connection was accepted.
+sub accepted {
+    return $CSH::WebLogin::Server::Request::ACCEPTED;
+}
+
+# Send a status message to the manager, if there is one.
+sub notify {
+    my ($self, $message) = @_;
+    return unless $self->{status_writer};
+    syswrite ($self->{status_writer}, "$$ $message\n");
+    return;
+}
+
+# Called by a worker once it has warmed up, just before it starts accepting
+# requests.
+sub worker_ready {
+    my ($self) = @_;
+    $self->notify ('ready');
+    return;
+}
+
+# Called by a worker when it has accepted a request.
+sub request_start {
+    my ($self) = @_;
+    $self->notify ('busy');
+    return;
+}
+
+# Called by a worker when it has finished a request, with a summary of the
+# request for the metrics.
+sub request_finish {
+    my ($self, $summary) = @_;
+    $self->notify ("done $summary");
+    return;
+}
+
+# Called by a worker with a beacon from a browser, for the metrics.
+sub record_beacon {
+    my ($self, $beacon) = @_;
+    $self->notify ("rum $beacon");
+    return;
+}
+
+# Called by a worker after each request.  Returns true if the worker has
+# reached its request or memory limit and should now exit, in which case the
+# manager has already been told to start its replacement.  Without a
+# manager, also returns true once the script has been modified since this
+# process started.
+sub request_done {
+    my ($self) = @_;
+    $self->{requests}++;
+    my $retire = $self->{max_requests}
+        && $self->{requests} >= $self->{max_requests};
+    if (!$retire && $self->{max_rss}
+        && $self->{requests} % $RSS_INTERVAL == 0) {
+        $retire = rss () > $self->{max_rss};
+    }
+    if (!$retire && !$self->{listen}) {
+        my $script = $ENV{SCRIPT_FILENAME};
+        $retire = defined ($script) && -e $script && -M _ < 0;
+    }
+    $self->notify ('retiring') if $retire;
+    return $retire;
+}
+
+# Open the listening socket, or reuse the one passed on by the server we
+# were re-executed from.
+sub open_socket {
+    my ($self) = @_;
+    my $listen = $self->{listen};
+    if (defined $ENV{$LISTEN_FD_ENV}) {
+        my $fd = delete $ENV{$LISTEN_FD_ENV};
+        return $fd;
+    }
+    unlink $listen if $listen =~ m{^/} && -S $listen;
+    my $socket = FCGI::OpenSocket ($listen, $BACKLOG);
+    die "weblogin: cannot listen on $listen\n" unless defined $socket;
+    return $socket;
+}
+
+# Clear the close-on-exec flag of a file handle so that it survives a reload.
+sub keep_on_exec {
+    my ($fh) = @_;
+    my $flags = fcntl ($fh, F_GETFD, 0) or return;
+    fcntl ($fh, F_SETFD, $flags & ~FD_CLOEXEC);
+    return;
+}
+
+# Create the status pipe, or take over the one used by the server we were
+# re-executed from, which its workers are still writing to, along with
+# those workers.
+sub open_status {
+    my ($self) = @_;
+    if (defined $ENV{$STATUS_FD_ENV}) {
+        my ($reader, $writer) = split (/,/, delete $ENV{$STATUS_FD_ENV});
+        $self->{status_reader} = IO::Handle->new_from_fd ($reader, 'r');
+        $self->{status_writer} = IO::Handle->new_from_fd ($writer, 'w');
+        die "weblogin: cannot take over status pipe: $!\n"
+            unless $self->{status_reader} && $self->{status_writer};
+        my $old = delete ($ENV{$OLD_WORKERS_ENV}) || '';
+        for my $pid (grep { /^\d+\z/ } split (/,/, $old)) {
+            $self->{old}{$pid} = 1 if kill (0, $pid);
+        }
+        $self->{handoff} = time;
+    } else {
+        pipe ($self->{status_reader}, $self->{status_writer})
+            or die "weblogin: cannot create status pipe: $!\n";
+    }
+    $self->{status_writer}->autoflush (1);
+    return;
+}
+
+# Open the socket metrics are served on.  A Unix socket path starts with a
+# slash; anything else is a TCP host:port.
+sub open_metrics {
+    my ($self) = @_;
+    my $addr = $self->{metrics_addr};
+    my $socket;
+    if ($addr =~ m{^/}) {
+        unlink $addr if -S $addr;
+        $socket = IO::Socket::UNIX->new (Local => $addr, Listen => 5);
+    } else {
+        $socket = IO::Socket::INET->new (LocalAddr => $addr, Listen => 5,
+                                         ReuseAddr => 1);
+    }
+    die "weblogin: cannot listen for metrics on $addr: $!\n" unless $socket;
+    return $socket;
+}
+
+# Answer one metrics scrape.  Any request gets the metrics, since the socket
+# serves nothing else.
+sub serve_metrics {
+    my ($self) = @_;
+    my $client = $self->{metrics_socket}->accept or return;
+    my $request = '';
+    my $bits = '';
+    vec ($bits, fileno ($client), 1) = 1;
+    while ($request !~ /\r?\n\r?\n/) {
+        last unless select (my $ready = $bits, undef, undef, $METRICS_TIMEOUT);
+        last unless sysread ($client, $request, 4096, length $request);
+    }
+    my $busy = keys %{ $self->{busy} };
+    my $retiring = keys %{ $self->{retiring} };
+    my $starting = keys (%{ $self->{children} }) - keys (%{ $self->{ready} });
+    my $body = $self->{metrics}->render (
+        busy     => $busy,
+        idle     => keys (%{ $self->{children} }) - $busy - $retiring
+                    - $starting,
+        retiring => $retiring,
+        starting => $starting,
+        draining => scalar (keys %{ $self->{old} }),
+        pool     => $self->{workers},
+        max      => $self->{max_workers},
+    );
+    print {$client} "HTTP/1.0 200 OK\r\n",
+        "Content-Type: text/plain; version=0.0.4\r\n",
+        'Content-Length: ', length ($body), "\r\n",
+        "Connection: close\r\n\r\n", $body;
+    close $client;
+    return;
+}
+
+# Return whether the driver as it now is on disk compiles, warning with the
+# errors if it doesn't, so that a broken deploy never replaces a working
+# pool.
+sub driver_compiles {
+    my ($self) = @_;
+    my $pid = open (my $check, '-|');
+    if (!defined $pid) {
+        warn "weblogin: cannot check $0: $!\n";
+        return 1;
+    } elsif ($pid == 0) {
+        open (STDERR, '>&', \*STDOUT);
+        exec ($^X, '-c', $0) or exit 1;
+    }
+    my $output = do { local $/; <$check> };
+    close $check;
+    return 1 if $? == 0;
+    warn "weblogin: not reloading, $0 does not compile:\n", $output;
+    return 0;
+}
+
+# Re-execute the driver with its original arguments, passing on the
+# listening socket, the status pipe, and the current workers, which become
+# the new driver's old generation and keep serving until its own workers
+# are ready.
+sub reexec {
+    my ($self) = @_;
+    $ENV{$LISTEN_FD_ENV} = $self->{socket};
+    my @workers = (keys %{ $self->{children} }, keys %{ $self->{old} });
+    if (@workers) {
+        my @pipe = ($self->{status_reader}, $self->{status_writer});
+        keep_on_exec ($_) for @pipe;
+        $ENV{$STATUS_FD_ENV} = join (',', map { fileno $_ } @pipe);
+        $ENV{$OLD_WORKERS_ENV} = join (',', @workers);
+    }
+    exec ($^X, $0, @{ $self->{argv} })
+        or die "weblogin: cannot re-execute $0: $!\n";
+}
+
+# Fork one worker process.  The child points CGI::Fast at the shared socket,
+# runs the handler until it returns, and exits.  Returns true on success.
+sub spawn {
+    my ($self, $handler) = @_;
+    my $pid = fork;
+    if (!defined $pid) {
+        warn "weblogin: cannot fork worker: $!\n";
+        return 0;
+    } elsif ($pid == 0) {
+        $SIG{$_} = 'DEFAULT' for qw(TERM INT HUP CHLD);
+        close $self->{status_reader};
+        close $self->{metrics_socket} if $self->{metrics_socket};
+        no warnings 'once';
+        $CGI::Fast::Ext_Request = $self->new_request ($self->{socket});
+        $handler->();
+        exit 0;
+    }
+    $self->{children}{$pid} = Time::HiRes::time ();
+    $self->{metrics}->worker_started;
+    return 1;
+}
+
+# Reap any workers that have exited.
+sub reap {
+    my ($self) = @_;
+    while ((my $pid = waitpid (-1, WNOHANG)) > 0) {
+        delete $self->{children}{$pid};
+        delete $self->{retiring}{$pid};
+        delete $self->{busy}{$pid};
+        delete $self->{ready}{$pid};
+        delete $self->{idle_since}{$pid};
+        delete $self->{old}{$pid};
+    }
+    return;
+}
+
+# Return the number of workers that are not retiring.
+sub active {
+    my ($self) = @_;
+    return keys (%{ $self->{children} }) - keys (%{ $self->{retiring} });
+}
+
+# Wait up to $timeout seconds for status messages from the workers or a
+# metrics scrape, and process whatever arrives.
+sub read_status {
+    my ($self, $timeout) = @_;
+    my $bits = '';
+    vec ($bits, fileno ($self->{status_reader}), 1) = 1;
+    my $metrics = $self->{metrics_socket};
+    vec ($bits, fileno ($metrics), 1) = 1 if $metrics;
+    return unless select (my $ready = $bits, undef, undef, $timeout) > 0;
+    $self->serve_metrics if $metrics && vec ($ready, fileno ($metrics), 1);
+    return unless vec ($ready, fileno ($self->{status_reader}), 1);
+    my $data;
+    return unless sysread ($self->{status_reader}, $data, 65536);
+    $self->{status} .= $data;
+    while ($self->{status} =~ s/^(\d+) (\S+)(?: ([^\n]*))?\n//) {
+        my ($pid, $message, $args) = ($1, $2, $3);
+        if ($self->{old}{$pid}) {
+            if ($message eq 'done' && defined $args) {
+                $self->{metrics}->record ($args);
+            }
+            next;
+        }
+        next unless $self->{children}{$pid};
+        if ($message eq 'ready') {
+            $self->{ready}{$pid} = 1;
+            $self->{idle_since}{$pid} = time;
+            my $startup = Time::HiRes::time () - $self->{children}{$pid};
+            $self->{metrics}->worker_ready ($startup);
+        } elsif ($message eq 'retiring') {
+            $self->{retiring}{$pid} = 1;
+        } elsif ($message eq 'busy') {
+            $self->{busy}{$pid} = time;
+            delete $self->{idle_since}{$pid};
+        } elsif ($message eq 'done') {
+            delete $self->{busy}{$pid};
+            $self->{idle_since}{$pid} = time;
+            $self->{metrics}->record ($args) if defined $args;
+        } elsif ($message eq 'rum') {
+            $self->{metrics}->record_rum ($args) if defined $args;
+        }
+    }
+    return;
+}
+
+# Return the workers that are ready and neither busy nor retiring.
+sub idle_workers {
+    my ($self) = @_;
+    return grep { !$self->{busy}{$_} && !$self->{retiring}{$_} }
+           keys %{ $self->{ready} };
+}
+
+# Grow the pool by one worker if every worker is busy and none is still
+# starting, up to the maximum, or retire one extra worker that has been idle
+# for long enough.
+sub resize {
+    my ($self, $handler) = @_;
+    my @idle = $self->idle_workers;
+    my $starting = keys (%{ $self->{children} }) - keys (%{ $self->{ready} });
+    if (!@idle && !$starting && $self->active < $self->{max_workers}) {
+        $self->spawn ($handler);
+        return;
+    }
+    return unless $self->active > $self->{workers};
+    my $now = time;
+    for my $pid (sort { $a <=> $b } @idle) {
+        next if $now - $self->{idle_since}{$pid} < $SPARE_TIMEOUT;
+        $self->{retiring}{$pid} = 1;
+        kill ('TERM', $pid);
+        last;
+    }
+    return;
+}
+
+# Kill any worker that has been busy with one request for longer than the
+# request timeout and the grace period.
+sub kill_stuck {
+    my ($self) = @_;
+    my $limit = time - $self->{timeout} - $KILL_GRACE;
+    for my $pid (keys %{ $self->{busy} }) {
+        next if $self->{busy}{$pid} > $limit;
+        warn "weblogin: killing worker $pid, busy for over"
+            . " $self->{timeout} seconds\n";
+        kill ('KILL', $pid);
+        delete $self->{busy}{$pid};
+        $self->{metrics}->worker_killed;
+    }
+    return;
+}
+
+# Once every worker of the new generation is ready, tell the old generation
+# left from before a reload to exit after finishing its current requests.
+# They are reaped like any other worker.
+sub drain_old {
+    my ($self) = @_;
+    my @waiting = grep { $self->{old}{$_} == 1 } keys %{ $self->{old} };
+    return unless @waiting;
+    my $ready = grep { !$self->{retiring}{$_} } keys %{ $self->{ready} };
+    if ($ready < $self->{workers}) {
+        if ($self->{handoff} && time - $self->{handoff} > $HANDOFF_WARN) {
+            warn "weblogin: new workers not ready after $HANDOFF_WARN"
+                . " seconds, old workers still serving\n";
+            $self->{handoff} = 0;
+        }
+        return;
+    }
+    kill ('TERM', @waiting);
+    $self->{old}{$_} = 2 for @waiting;
+    return;
+}
+
+# Ask all workers, old and new, to exit once they finish their current
+# request and wait for them.  Idle workers exit immediately.
+sub stop_workers {
+    my ($self) = @_;
+    kill ('TERM', keys %{ $self->{children} }, keys %{ $self->{old} });
+    while (keys %{ $self->{children} } || keys %{ $self->{old} }) {
+        my $pid = waitpid (-1, 0);
+        last if $pid < 0;
+        delete $self->{children}{$pid};
+        delete $self->{old}{$pid};
+    }
+    return;
+}
+
+# Run the handler.  With a listen address, open the socket and keep the pool
+# of workers full until we get SIGTERM or SIGINT, then stop the workers and
+# wait for them.  On SIGHUP or a change to a watched file, re-execute the
+# driver to pick up the new code, leaving the workers running until the new
+# driver's workers take over from them.
+sub run {
+    my ($self, $handler) = @_;
+    if (!$self->{listen}) {
+        no warnings 'once';
+        $CGI::Fast::Ext_Request = $self->new_request;
+        $handler->();
+        return;
+    }
+    $self->{socket} = $self->open_socket;
+    $self->open_status;
+    $self->{metrics_socket} = $self->open_metrics if $self->{metrics_addr};
+    local $SIG{TERM} = sub { $self->{stopping} = 1 };
+    local $SIG{INT}  = sub { $self->{stopping} = 1 };
+    local $SIG{HUP}  = sub { $self->{reloading} = 1 };
+    local $SIG{CHLD} = sub { };
+    my $watcher = CSH::WebLogin::Watcher->new (@{ $self->{watch} });
+    my $next_check = time + $WATCH_INTERVAL;
+    while (!$self->{stopping} && !$self->{reloading}) {
+        while ($self->active < $self->{workers}) {
+            $self->spawn ($handler) or last;
+        }
+        $self->read_status (1);
+        $self->reap;
+        $self->kill_stuck if $self->{timeout};
+        if ($self->{max_workers} > $self->{workers}) {
+            $self->resize ($handler);
+        }
+        $self->drain_old if %{ $self->{old} };
+        if (time >= $next_check) {
+            $self->{reloading} = 1 if $watcher->changed;
+            $next_check = time + $WATCH_INTERVAL;
+        }
+        if ($self->{reloading} && !$self->{stopping}
+            && !$self->driver_compiles) {
+            $self->{reloading} = 0;
+            $watcher->reset;
+        }
+    }
+    if ($self->{metrics_socket}) {
+        close $self->{metrics_socket};
+        my $addr = $self->{metrics_addr};
+        unlink $addr if $addr =~ m{^/};
+    }
+    $self->reexec if $self->{reloading} && !$self->{stopping};
+    $self->stop_workers;
+    FCGI::CloseSocket ($self->{socket});
+    unlink $self->{listen} if $self->{listen} =~ m{^/};
+    return;
+}
+
+# A FastCGI request that records when it last accepted a connection, so
+# that request timing can start from the moment the request arrived rather
+# than from when CGI::Fast finished parsing it.
+package CSH::WebLogin::Server::Request;
+
+our @ISA = qw(FCGI);
+
+# The time of the last successful Accept.
+our $ACCEPTED;
+
+sub Accept {
+    my ($self) = @_;
+    my $status = $self->SUPER::Accept ();
+    $ACCEPTED = Time::HiRes::time ();
+    return $status;
+}
+
+1;
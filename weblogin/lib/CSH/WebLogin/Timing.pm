@@ -0,0 +1,158 @@
+# CSH::WebLogin::Timing -- Per-request phase timing for the driver.
+#
+# Splits the time spent on each request into phases: parse (from accepting
+# the FastCGI connection until CGI::Fast has parsed the request), webkdc
+# (calls into the WebKDC), render (template processing), and total.  The
+# phases are reported to the browser in a Server-Timing header, added by a
+# postrun callback so that it goes out with the page, and optionally logged
+# to standard error as one line per request tagged with the run mode.
+#
+# WebLogin itself isn't modified.  Instead, the WebKDC request functions and
+# WebLogin's template processing method are wrapped to time themselves, with
+# CSH::WebLogin::Wrap.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Timing;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use CSH::WebLogin::Wrap qw(wrap_tt_process wrap_webkdc_requests);
+use Time::HiRes qw(time);
+
+# The phases, in reporting order.
+our @PHASES = qw(parse webkdc render total);
+
+# Create a new timer and instrument the given WebLogin object.  Takes a hash
+# of options: log, true to write a log line for each request.
+sub new {
+    my ($class, $weblogin, %args) = @_;
+    my $self = bless ({ log => $args{log}, phases => {} }, $class);
+    $self->instrument ($weblogin);
+    return $self;
+}
+
+# Return a wrapper that adds the time the wrapped function takes to the
+# given phase and then calls $callback, if given, with its arguments.
+sub timer {
+    my ($self, $phase, $callback) = @_;
+    return sub {
+        my ($original, @args) = @_;
+        my $start = time;
+        my @result = wantarray ? $original->(@args)
+                               : scalar $original->(@args);
+        $self->{phases}{$phase} += time - $start;
+        $self->{calls}{$phase}++;
+        $callback->(@args) if $callback;
+        return wantarray ? @result : $result[0];
+    };
+}
+
+# Wrap the WebKDC request functions and template processing, and register a
+# postrun callback that adds the Server-Timing header.
+sub instrument {
+    my ($self, $weblogin) = @_;
+    wrap_webkdc_requests ($self->timer ('webkdc'));
+    my $record = sub {
+        my ($app, $template, $params) = @_;
+        $self->{template} ||= $template if defined $template;
+        if (ref ($params) eq 'HASH') {
+            push (@{ $self->{errors} },
+                  grep { /^err_/ && $params->{$_} } sort keys %$params);
+        }
+    };
+    wrap_tt_process ($weblogin, $self->timer ('render', $record));
+    $weblogin->add_callback ('postrun', sub {
+        my ($app) = @_;
+        $self->{rm} = $app->get_current_runmode;
+        $app->header_add (-Server_Timing => $self->server_timing);
+    });
+    return;
+}
+
+# Set the run mode for a request that the driver handled itself, without
+# running WebLogin.
+sub run_mode {
+    my ($self, $rm) = @_;
+    $self->{rm} = $rm;
+    return;
+}
+
+# Add to a per-request counter that is included in the summary, such as the
+# number of new WebKDC connections.
+sub count {
+    my ($self, $name, $count) = @_;
+    $self->{counts}{$name} += defined ($count) ? $count : 1;
+    return;
+}
+
+# Start timing a new request, given the time its connection was accepted.
+# Everything up to now counts as parsing.
+sub start {
+    my ($self, $accepted) = @_;
+    my $now = time;
+    $accepted = $now unless defined $accepted;
+    $self->{start} = $accepted;
+    $self->{phases} = { parse => $now - $accepted };
+    $self->{calls} = {};
+    $self->{counts} = {};
+    $self->{errors} = [];
+    $self->{rm} = undef;
+    $self->{template} = undef;
+    return;
+}
+
+# Return the elapsed time for each phase in milliseconds, as a hash.
+sub phases {
+    my ($self) = @_;
+    my %phases = %{ $self->{phases} };
+    $phases{total} = time - $self->{start};
+    return map { $_ => sprintf ('%.1f', ($phases{$_} || 0) * 1000) } @PHASES;
+}
+
+# Return the value of the Server-Timing header for the request so far.
+sub server_timing {
+    my ($self) = @_;
+    my %phases = $self->phases;
+    return join (', ', map { "$_;dur=$phases{$_}" } @PHASES);
+}
+
+# Return a one-line summary of the request as space-separated key=value
+# pairs: the run mode, the template, the phase times in milliseconds, the
+# number of WebKDC calls, any other counters, and any error flags set for the
+# template.
+sub summary {
+    my ($self) = @_;
+    my %phases = $self->phases;
+    my @fields = (rm       => $self->{rm},
+                  template => $self->{template},
+                  (map { $_ => $phases{$_} } @PHASES),
+                  webkdc_calls => $self->{calls}{webkdc} || 0);
+    my $counts = $self->{counts};
+    push (@fields, map { $_ => $counts->{$_} } sort keys %$counts);
+    my @pairs;
+    while (my ($key, $value) = splice (@fields, 0, 2)) {
+        $value = '-' unless defined ($value) && length ($value);
+        $value =~ s/\s/_/g;
+        push (@pairs, "$key=$value");
+    }
+    push (@pairs, 'errors=' . join (',', @{ $self->{errors} }))
+        if @{ $self->{errors} };
+    return join (' ', @pairs);
+}
+
+# Finish timing a request, logging it if configured to.  Returns the phase
+# times in milliseconds as a hash.
+sub finish {
+    my ($self) = @_;
+    my %phases = $self->phases;
+    if ($self->{log}) {
+        print STDERR 'weblogin: timing ', $self->summary, "\n";
+    }
+    return %phases;
+}
+
+1;
@@ -0,0 +1,94 @@
+# CSH::WebLogin::UserInfo -- Remember user information across MFA requests.
+#
+# The user information service is queried by the WebKDC, not by weblogin:
+# what it says about a user reaches us only on the WebKDC's response to a
+# login, as the user_message and factor details passed to multifactor.tmpl.
+# Requests that don't go back to the WebKDC for a fresh answer, such as
+# multifactor_sendauth re-rendering the page after sending a code, have no
+# user information at all, and anything that did would repeat the lookup.
+#
+# So this keeps the user information shown with the multifactor page in a
+# CSH::WebLogin::Cache, keyed by the login's request token and the factor
+# type, fills it back in when multifactor_sendauth shows the page again
+# without it, and forgets it once the user reaches the confirmation page
+# after a successful login.  The key never comes from the username field,
+# which the browser controls, so one login can't see or replace another
+# user's information.  Pages rendered with an error, such as a wrong code,
+# are left alone so that the error isn't hidden behind a stale message.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::UserInfo;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use CSH::WebLogin::Wrap qw(wrap_tt_process);
+use Digest::SHA qw(sha256_hex);
+
+# The multifactor template parameters that come from the user information
+# service and are cached.
+our @FIELDS = qw(user_message);
+
+# The run mode that shows the multifactor page again without asking the
+# WebKDC, and so gets the cached information.
+our $REFILL_RUN_MODE = 'multifactor_sendauth';
+
+# Return the cache key for a login's request token, or undef if there is
+# none.  The token is long, so it is hashed.
+sub request_key {
+    my ($cache, $rt) = @_;
+    return unless defined ($rt) && length ($rt);
+    return $cache->key ('userinfo', sha256_hex ($rt));
+}
+
+# Before the multifactor page is rendered: cache the user information it
+# was given, or, if $refill is true and the page shows no error, fill it in
+# from the cache if it was given none.
+sub multifactor {
+    my ($cache, $key, $params, $refill) = @_;
+    my $type = defined ($params->{factor_type}) ? $params->{factor_type} : '';
+    my %info = map { $_ => $params->{$_} }
+               grep { defined $params->{$_} } @FIELDS;
+    my $cached = $cache->get ($key) || {};
+    if (%info) {
+        $cached->{$type} = \%info;
+        $cache->set ($key, $cached);
+    } elsif ($refill && $cached->{$type}
+             && !grep { /^err_/ && $params->{$_} } keys %$params) {
+        %$params = (%$params, %{ $cached->{$type} });
+    }
+    return;
+}
+
+# Install the cache into a WebLogin object.  Takes the WebLogin object and a
+# hash of options: cache, the CSH::WebLogin::Cache to use; and pages, the
+# driver's hash of page templates.
+sub install {
+    my ($class, $weblogin, %args) = @_;
+    my $cache = $args{cache};
+    my $multifactor = $args{pages}{multifactor};
+    my $confirm = $args{pages}{confirm};
+    wrap_tt_process ($weblogin, sub {
+        my ($process, @args) = @_;
+        my ($app, $name, $params) = @args;
+        if (defined ($name) && ref ($params) eq 'HASH') {
+            my $rt = $params->{RT};
+            $rt = $app->query->param ('RT') unless defined $rt;
+            my $key = request_key ($cache, $rt);
+            if (defined ($key) && $name eq $multifactor) {
+                my $rm = $app->get_current_runmode;
+                my $refill = defined ($rm) && $rm eq $REFILL_RUN_MODE;
+                multifactor ($cache, $key, $params, $refill);
+            } elsif (defined ($key) && $name eq $confirm) {
+                $cache->delete ($key);
+            }
+        }
+        return $process->(@args);
+    });
+    return;
+}
+
+1;
@@ -0,0 +1,106 @@
+# CSH::WebLogin::Watcher -- Notice when deployed files change.
+#
+# The FastCGI server uses this to decide when to reload its workers after a
+# deploy, so that the workers themselves never have to check anything on
+# disk between requests.  It watches a list of files and directories (the
+# driver, the modules it loaded, the templates, and the WebKDC
+# configuration) using inotify if Linux::Inotify2 is installed, and
+# otherwise by comparing modification times each time it is polled.
+#
+# Deploys usually replace files by renaming new ones over them, which ends
+# the inotify watch on the old file, so resetting the watcher after a refused
+# reload builds a new set of watches over the files now on disk rather than
+# reusing the old ones.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Watcher;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use File::Find qw(find);
+
+# Create a new watcher for the given list of paths.  Paths that don't exist
+# are ignored.
+sub new {
+    my ($class, @paths) = @_;
+    my $self = bless ({ paths => [ grep { defined && -e } @paths ] }, $class);
+    $self->{inotify} = $self->inotify;
+    $self->{snapshot} = $self->snapshot unless $self->{inotify};
+    return $self;
+}
+
+# Return a new Linux::Inotify2 object watching every file, or undef if
+# inotify isn't available.
+sub inotify {
+    my ($self) = @_;
+    return unless eval { require Linux::Inotify2; 1 };
+    my $inotify = Linux::Inotify2->new or return;
+    $inotify->blocking (0);
+    my $mask = Linux::Inotify2::IN_MODIFY ()
+        | Linux::Inotify2::IN_ATTRIB ()
+        | Linux::Inotify2::IN_CREATE ()
+        | Linux::Inotify2::IN_DELETE ()
+        | Linux::Inotify2::IN_MOVE ()
+        | Linux::Inotify2::IN_DELETE_SELF ()
+        | Linux::Inotify2::IN_MOVE_SELF ();
+    $inotify->watch ($_, $mask) for $self->files;
+    return $inotify;
+}
+
+# Return the watched paths, with directories expanded to themselves plus
+# everything under them.
+sub files {
+    my ($self) = @_;
+    my @files;
+    for my $path (@{ $self->{paths} }) {
+        if (-d $path) {
+            find ({ wanted => sub { push (@files, $_) }, no_chdir => 1 },
+                  $path);
+        } else {
+            push (@files, $path);
+        }
+    }
+    return @files;
+}
+
+# Return a string summarizing the modification time and size of every
+# watched file, for comparison with later polls.
+sub snapshot {
+    my ($self) = @_;
+    my @state;
+    for my $file (sort $self->files) {
+        my ($size, $mtime) = (stat $file)[7, 9];
+        push (@state, join (':', $file, $size || 0, $mtime || 0));
+    }
+    return join ("\n", @state);
+}
+
+# Return true if anything watched has changed since the watcher was created
+# or last reset.
+sub changed {
+    my ($self) = @_;
+    if ($self->{inotify}) {
+        my @events = $self->{inotify}->read;
+        $self->{changed} ||= @events > 0;
+        return $self->{changed};
+    }
+    return $self->snapshot ne $self->{snapshot};
+}
+
+# Forget the changes seen so far, so that only later ones count, and watch
+# the files now on disk rather than the ones a deploy may have replaced.
+sub reset {
+    my ($self) = @_;
+    if ($self->{inotify}) {
+        $self->{inotify} = $self->inotify;
+        $self->{changed} = 0;
+    }
+    $self->{snapshot} = $self->snapshot unless $self->{inotify};
+    return;
+}
+
+1;
@@ -0,0 +1,61 @@
+# CSH::WebLogin::Wrap -- Wrap WebKDC and WebLogin functions in place.
+#
+# The driver extensions change what WebLogin does without modifying it, by
+# replacing the WebKDC request functions or WebLogin's template processing
+# method with closures that call the original.  Each wrapper is given the
+# original function followed by the arguments it was called with.
+#
+# Wrapping the same function again wraps the previous wrapper, so the last
+# extension installed runs first; the driver installs them in an order that
+# accounts for that.
+#
+# See LICENSE for licensing terms.
+
+package CSH::WebLogin::Wrap;
+
+require 5.006;
+
+use strict;
+use warnings;
+
+use Exporter qw(import);
+
+our @EXPORT_OK = qw(wrap_function wrap_tt_process wrap_webkdc_requests);
+
+# Replace the named function with a call to $wrapper, passing it the
+# original function and the arguments.  Returns false and does nothing if
+# there is no such function.
+sub wrap_function {
+    my ($name, $wrapper) = @_;
+    no strict 'refs';
+    return 0 unless defined (&$name);
+    my $original = \&$name;
+    no warnings 'redefine';
+    *$name = sub { return $wrapper->($original, @_) };
+    return 1;
+}
+
+# Wrap every WebKDC request function, make_<type>_request.
+sub wrap_webkdc_requests {
+    my ($wrapper) = @_;
+    for my $symbol (sort keys %WebKDC::) {
+        next unless $symbol =~ /^make_\w+_request\z/;
+        wrap_function ("WebKDC::$symbol", $wrapper);
+    }
+    return;
+}
+
+# Wrap the template processing method of a WebLogin object, which usually
+# comes from CGI::Application::Plugin::TT, in the object's own class.
+# Returns false and does nothing if it has none.
+sub wrap_tt_process {
+    my ($weblogin, $wrapper) = @_;
+    my $process = $weblogin->can ('tt_process') or return 0;
+    my $class = ref $weblogin;
+    no strict 'refs';
+    no warnings 'redefine';
+    *{"${class}::tt_process"} = sub { return $wrapper->($process, @_) };
+    return 1;
+}
+
+1;